@@ -0,0 +1,430 @@
+"""Output-equivalence and throughput harness for the cleaning / conversion code.
+
+Runs every implementation on generated datasets (plus edge cases) and checks
+that the working tree still produces the same output as a reference revision:
+
+    trajectory_fixer_c.c      plain file, stdin/stdout and every optional build
+                              (io_uring, gzip, zstd) against the reference build
+    trajectory_fixer.py       against its reference revision (needs numpy)
+    my_converter.py           raw input, against its reference revision
+    mapmatched_converter.py   fixed input, against its reference revision
+    my_converter_c.c          fixed input, against its reference revision and
+                              against mapmatched_converter.py
+
+Tolerance: record counts, ids and timestamps must match exactly; latitudes and
+longitudes may differ by at most COORD_TOLERANCE degrees (one unit in the last
+of the 8 printed decimals, about 1 mm). my_converter_c writes -1 as every
+trajectory id and one line per trajectory instead of one per driver, so it is
+checked against mapmatched_converter.py on the flattened coordinate sequence.
+Differences listed in KNOWN_DIFFERENCES are reported but do not fail the run.
+
+Reference C programs are built at -O0: before the async I/O work newStopWatch
+had no return statement and those revisions crash when optimized. Their
+throughput is not reported. The default reference, HEAD, checks uncommitted
+changes; pass the last revision before a series (e.g. --reference 1bd7b70) to
+check the whole series. The stdin variant feeds the input and reads the output
+through pipes, so it covers the non-seekable path.
+
+Usage:
+    python3 compare_implementations.py [--reference REV] [--points N] [--repeat K]
+                                       [--cflags FLAGS] [--keep DIR]
+
+Exits with 1 when any output differs or fails to run.
+"""
+import argparse
+import gzip
+import os
+import random
+import shlex
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+REPO = os.path.dirname(os.path.abspath(__file__))
+COORD_TOLERANCE = 1e-8
+HEADER = 'id;lat;lng;timestamp\n'
+
+KNOWN_DIFFERENCES = {
+    # comparePoints in trajectory_fixer_c.c returns the timestamp difference as an int, so gaps
+    # beyond 2^31 ms sort inconsistently and a driver's trajectories come out of time order,
+    # while mapmatched_converter.py sorts each driver by time.
+    ('timestamp_gaps_64bit', 'my_converter_c ~ mapmatched'): 'comparePoints truncates 64-bit gaps',
+}
+
+# ---------------------------------------------------------------------------
+# ------------------------------   Datasets   -------------------------------
+
+def random_walks(rnd, n_points, dt_choices=(0, 1000, 5000, 10000, 40000), speed=0.00005, jump=0.01, min_len=50, max_len=800):
+    rows = []
+    tid = 0
+    while len(rows) < n_points:
+        lat, lng = -3.7 + rnd.random() * 0.1, -38.5 + rnd.random() * 0.1
+        v_lat, v_lng = rnd.gauss(0, speed), rnd.gauss(0, speed)
+        t = 1500000000000 + rnd.randint(0, 10**6)
+        for _ in range(rnd.randint(min_len, max_len)):
+            dt = rnd.choice(dt_choices)
+            if dt <= 40000:
+                lat += v_lat * dt / 1000 + rnd.gauss(0, 0.00002)
+                lng += v_lng * dt / 1000 + rnd.gauss(0, 0.00002)
+            if rnd.random() < jump:
+                lat += 0.05
+            t += dt
+            rows.append((tid, lat, lng, t))
+        tid += 1
+    return rows
+
+def by_driver(rows):
+    blocks = []
+    for row in rows:
+        if not blocks or blocks[-1][0][0] != row[0]:
+            blocks.append([])
+        blocks[-1].append(row)
+    return blocks
+
+def duplicate_timestamps(rnd, n_points):
+    rows = []
+    for row in random_walks(rnd, n_points, dt_choices=(0, 0, 0, 1000, 5000)):
+        rows.append(row)
+        if rnd.random() < 0.1:
+            rows.append(row)
+    return rows
+
+def out_of_order(rnd, n_points):
+    rows = []
+    for block in by_driver(random_walks(rnd, n_points)):
+        rnd.shuffle(block)
+        rows.extend(block)
+    return rows
+
+def first_point_dropped(rnd, n_points):
+    # fast, jumpy drivers: many short sub-trajectories, each losing its first point in writeTrajectory
+    return random_walks(rnd, n_points, dt_choices=(5000, 10000), speed=0.0001, jump=0.07, min_len=20, max_len=200)
+
+def timestamp_gaps_64bit(rnd, n_points):
+    return random_walks(rnd, n_points, dt_choices=(1000, 5000, 10000, 2**31 + 1000, 2**32 + 5000, 2**33))
+
+DATASETS = [
+    ('random', random_walks),
+    ('duplicate_timestamps', duplicate_timestamps),
+    ('out_of_order', out_of_order),
+    ('first_point_dropped', first_point_dropped),
+    ('timestamp_gaps_64bit', timestamp_gaps_64bit),
+]
+
+def write_dataset(path, rows):
+    with open(path, 'w') as f:
+        f.write(HEADER)
+        for tid, lat, lng, t in rows:
+            f.write('{};{:.8f};{:.8f};{}\n'.format(tid, lat, lng, t))
+
+# ---------------------------------------------------------------------------
+# -----------------------------   Comparison   ------------------------------
+
+def open_text(path):
+    if path.endswith('.gz'):
+        return gzip.open(path, 'rt')
+    if path.endswith('.zst'):
+        return subprocess.run(['zstd', '-dcq', path], stdout=subprocess.PIPE, universal_newlines=True, check=True).stdout.splitlines(True)
+    return open(path)
+
+def read_lines(path):
+    lines = open_text(path)
+    try:
+        return [line.rstrip('\r\n') for line in lines]
+    finally:
+        if hasattr(lines, 'close'):
+            lines.close()
+
+def compare_fields(expected, actual, coords):
+    if len(expected) != len(actual):
+        return 'expected {} fields, found {}'.format(len(expected), len(actual))
+    for i, (e, a) in enumerate(zip(expected, actual)):
+        if e == a:
+            continue
+        try:
+            if i in coords(len(expected)) and abs(float(e) - float(a)) <= COORD_TOLERANCE:
+                continue
+        except ValueError: # header
+            pass
+        return 'field {}: {} != {}'.format(i, e, a)
+    return None
+
+def compare_outputs(expected_path, actual_path, coords):
+    """Returns None when equivalent, otherwise a description of the first difference."""
+    expected, actual = read_lines(expected_path), read_lines(actual_path)
+    if len(expected) != len(actual):
+        return '{} lines, expected {}'.format(len(actual), len(expected))
+    for n, (e, a) in enumerate(zip(expected, actual)):
+        problem = compare_fields(e.split(';'), a.split(';'), coords)
+        if problem:
+            return 'line {}: {}'.format(n + 1, problem)
+    return None
+
+def fixed_coords(n_fields):
+    return (2, 3)
+
+def converted_coords(n_fields):
+    return range(1, n_fields)
+
+def flattened_coords(path):
+    values = []
+    for line in read_lines(path):
+        values.extend(float(v) for v in line.split(';')[1:])
+    return values
+
+def compare_flattened(expected_path, actual_path):
+    expected, actual = flattened_coords(expected_path), flattened_coords(actual_path)
+    if len(expected) != len(actual):
+        return '{} coordinates, expected {}'.format(len(actual), len(expected))
+    for n, (e, a) in enumerate(zip(expected, actual)):
+        if abs(e - a) > COORD_TOLERANCE:
+            return 'coordinate {}: {} != {}'.format(n, e, a)
+    return None
+
+# ---------------------------------------------------------------------------
+# ------------------------------   Engines   --------------------------------
+
+class EngineError(Exception):
+    pass
+
+def export_reference(rev, directory):
+    """Writes the sources of `rev` into `directory`, returns the names that exist there."""
+    os.makedirs(directory)
+    found = []
+    for name in ['trajectory_fixer_c.c', 'my_converter_c.c', 'trajectory_fixer.py', 'my_converter.py', 'mapmatched_converter.py']:
+        result = subprocess.run(['git', '-C', REPO, 'show', '{}:{}'.format(rev, name)], stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+        if result.returncode == 0:
+            with open(os.path.join(directory, name), 'wb') as f:
+                f.write(result.stdout)
+            found.append(name)
+    return found
+
+def compile_c(source, binary, cflags, extra=(), optimization='-O2'):
+    """Returns None on success, otherwise the first line of the compiler error."""
+    defines = [flag for flag in extra if not flag.startswith('-l')]
+    libs = [flag for flag in extra if flag.startswith('-l')]
+    command = [os.environ.get('CC', 'cc'), optimization] + defines + cflags + ['-o', binary, source, '-lm', '-lpthread'] + libs
+    result = subprocess.run(command, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, universal_newlines=True)
+    if result.returncode != 0:
+        errors = [line for line in result.stdout.splitlines() if 'error' in line] or result.stdout.splitlines() or ['failed']
+        return errors[0].strip()
+    return None
+
+def timed_run(command, cwd, repeat, stdin_path=None, stdout_path=None):
+    """With `stdin_path` / `stdout_path` the data goes through real pipes, so the
+    engine sees non-seekable stdin and stdout."""
+    best = None
+    data = None
+    if stdin_path:
+        with open(stdin_path, 'rb') as f:
+            data = f.read()
+    for _ in range(repeat):
+        start = time.perf_counter()
+        process = subprocess.Popen(command, cwd=cwd, stdin=subprocess.PIPE if data is not None else subprocess.DEVNULL,
+                                   stdout=subprocess.PIPE if stdout_path else subprocess.DEVNULL, stderr=subprocess.PIPE)
+        stdout, stderr = process.communicate(data)
+        elapsed = time.perf_counter() - start
+        if process.returncode != 0:
+            last_line = stderr.decode(errors='replace').strip().splitlines()[-1:]
+            raise EngineError('exit code {}{}'.format(process.returncode, ': ' + last_line[0] if last_line else ''))
+        if stdout_path:
+            with open(stdout_path, 'wb') as f:
+                f.write(stdout)
+        best = elapsed if best is None else min(best, elapsed)
+    return best
+
+def run_dir(root, *names):
+    path = os.path.join(root, *names)
+    os.makedirs(path, exist_ok=True)
+    return path
+
+def stage_input(directory, source, name):
+    target = os.path.join(directory, name)
+    if not os.path.exists(target):
+        os.symlink(source, target)
+    return name
+
+# ---------------------------------------------------------------------------
+# -------------------------------   Report   --------------------------------
+
+class Report:
+    def __init__(self):
+        self.rows = []
+        self.failed = False
+
+    def add(self, dataset, engine, status, n_points=None, seconds=None):
+        rate = '{:,.0f}'.format(n_points / seconds) if n_points and seconds else '-'
+        if status.startswith('DIFF') and (dataset, engine) in KNOWN_DIFFERENCES:
+            status = 'known {} ({})'.format(status, KNOWN_DIFFERENCES[dataset, engine])
+        self.rows.append((dataset, engine, status, rate))
+        if status.startswith(('DIFF', 'ERROR')):
+            self.failed = True
+        print('{:<22} {:<32} {:>14}  {}'.format(dataset, engine, rate, status), flush=True)
+
+    def header(self):
+        print('{:<22} {:<32} {:>14}  {}'.format('dataset', 'engine', 'points/s', 'status'))
+
+def status_of(problem):
+    return 'match' if problem is None else 'DIFF ' + problem
+
+# ---------------------------------------------------------------------------
+# --------------------------------   Main   ---------------------------------
+
+FIXER_VARIANTS = [
+    # name, build flags, how the data is handed over
+    ('trajectory_fixer_c', [], 'file'),
+    ('trajectory_fixer_c stdin', [], 'pipe'),
+    ('trajectory_fixer_c io_uring', ['-DUSE_IO_URING', '-luring'], 'file'),
+    ('trajectory_fixer_c gzip', ['-DUSE_ZLIB', '-lz'], '.gz'),
+    ('trajectory_fixer_c zstd', ['-DUSE_ZSTD', '-lzstd'], '.zst'),
+]
+
+def compress(path, extension):
+    if extension == '.gz':
+        with open(path, 'rb') as f, gzip.open(path + '.gz', 'wb') as out:
+            shutil.copyfileobj(f, out)
+    else:
+        subprocess.run(['zstd', '-qf', path, '-o', path + '.zst'], check=True)
+    return path + extension
+
+def main():
+    parser = argparse.ArgumentParser(description='Checks output equivalence and throughput of every implementation.')
+    parser.add_argument('--reference', default='HEAD', help='git revision holding the reference implementations (default: HEAD, i.e. check uncommitted changes)')
+    parser.add_argument('--points', type=int, default=50000, help='points per generated dataset')
+    parser.add_argument('--repeat', type=int, default=1, help='runs per engine, the fastest one is reported')
+    parser.add_argument('--cflags', default='', help='extra compiler flags, e.g. include / library paths')
+    parser.add_argument('--keep', help='work directory to keep instead of a temporary one')
+    args = parser.parse_args()
+
+    work = args.keep or tempfile.mkdtemp(prefix='compare_implementations_')
+    os.makedirs(work, exist_ok=True)
+    cflags = shlex.split(args.cflags)
+    python = sys.executable
+    report = Report()
+
+    reference_dir = os.path.join(work, 'reference')
+    if os.path.exists(reference_dir):
+        shutil.rmtree(reference_dir)
+    reference = export_reference(args.reference, reference_dir)
+
+    # -- builds
+    bin_dir = run_dir(work, 'bin')
+    fixer_builds = {}
+    for name, flags, _ in FIXER_VARIANTS:
+        binary = os.path.join(bin_dir, name.replace(' ', '_'))
+        fixer_builds[name] = (binary, compile_c(os.path.join(REPO, 'trajectory_fixer_c.c'), binary, cflags, flags))
+    converter_c = os.path.join(bin_dir, 'my_converter_c')
+    converter_c_error = compile_c(os.path.join(REPO, 'my_converter_c.c'), converter_c, cflags)
+    fixer_ref = converter_ref = None
+    if 'trajectory_fixer_c.c' in reference:
+        fixer_ref = os.path.join(bin_dir, 'reference_trajectory_fixer_c')
+        if compile_c(os.path.join(reference_dir, 'trajectory_fixer_c.c'), fixer_ref, cflags, optimization='-O0'):
+            fixer_ref = None
+    if 'my_converter_c.c' in reference:
+        converter_ref = os.path.join(bin_dir, 'reference_my_converter_c')
+        if compile_c(os.path.join(reference_dir, 'my_converter_c.c'), converter_ref, cflags, optimization='-O0'):
+            converter_ref = None
+    has_numpy = subprocess.run([python, '-c', 'import numpy'], stderr=subprocess.DEVNULL).returncode == 0
+    has_zstd_cli = shutil.which('zstd') is not None
+
+    print('Reference: {}  work directory: {}\n'.format(args.reference, work))
+    report.header()
+
+    for dataset, generate in DATASETS:
+        rows = generate(random.Random(dataset), args.points)
+        raw_name = dataset + '.csv'
+        raw = os.path.join(run_dir(work, 'data'), raw_name)
+        write_dataset(raw, rows)
+        n_raw = len(rows)
+
+        # -- trajectory_fixer_c
+        expected_fixed = None
+        if fixer_ref is not None:
+            directory = run_dir(work, 'runs', dataset, 'reference_trajectory_fixer_c')
+            try:
+                timed_run([fixer_ref, stage_input(directory, raw, raw_name)], directory, 1)
+                expected_fixed = os.path.join(directory, 'cfixed_' + raw_name)
+            except EngineError as e:
+                report.add(dataset, 'reference trajectory_fixer_c', 'ERROR ' + str(e))
+        for name, flags, mode in FIXER_VARIANTS:
+            binary, build_error = fixer_builds[name]
+            if build_error:
+                report.add(dataset, name, 'skipped (build: {})'.format(build_error))
+                continue
+            if mode == '.zst' and not has_zstd_cli:
+                report.add(dataset, name, 'skipped (no zstd command)')
+                continue
+            directory = run_dir(work, 'runs', dataset, name.replace(' ', '_'))
+            try:
+                if mode == 'pipe':
+                    output = os.path.join(directory, 'stdout.csv')
+                    seconds = timed_run([binary, '-', '-'], directory, args.repeat, stdin_path=raw, stdout_path=output)
+                else:
+                    source = raw if mode == 'file' else compress(raw, mode)
+                    input_name = stage_input(directory, source, os.path.basename(source))
+                    seconds = timed_run([binary, input_name], directory, args.repeat)
+                    output = os.path.join(directory, 'cfixed_' + input_name)
+            except (EngineError, subprocess.CalledProcessError) as e:
+                report.add(dataset, name, 'ERROR ' + str(e))
+                continue
+            if expected_fixed is None:
+                expected_fixed = output # no reference, later variants are checked against this one
+                report.add(dataset, name, 'no reference', n_raw, seconds)
+            else:
+                report.add(dataset, name, status_of(compare_outputs(expected_fixed, output, fixed_coords)), n_raw, seconds)
+
+        # -- python implementations and my_converter_c, each against its reference revision
+        fixed_name = 'fixed_input.csv'
+        n_fixed = len(read_lines(expected_fixed)) - 1 if expected_fixed else 0
+        def reference_command(script):
+            return [python, os.path.join(reference_dir, script)] if script in reference else None
+        engines = [
+            # name, candidate command, reference command, input, output prefix, points
+            ('trajectory_fixer.py', [python, os.path.join(REPO, 'trajectory_fixer.py')], reference_command('trajectory_fixer.py'), raw, raw_name, 'fixed_', n_raw),
+            ('my_converter.py', [python, os.path.join(REPO, 'my_converter.py')], reference_command('my_converter.py'), raw, raw_name, 'converted_', n_raw),
+            ('mapmatched_converter.py', [python, os.path.join(REPO, 'mapmatched_converter.py')], reference_command('mapmatched_converter.py'), expected_fixed, fixed_name, 'converted_', n_fixed),
+            ('my_converter_c', [converter_c], [converter_ref] if converter_ref else None, expected_fixed, fixed_name, 'converted_', n_fixed),
+        ]
+        outputs = {}
+        for name, command, reference_cmd, source, input_name, prefix, n_points in engines:
+            if source is None:
+                report.add(dataset, name, 'skipped (no trajectory_fixer_c output)')
+                continue
+            if name == 'trajectory_fixer.py' and not has_numpy:
+                report.add(dataset, name, 'skipped (numpy not installed)')
+                continue
+            if name == 'my_converter_c' and converter_c_error:
+                report.add(dataset, name, 'skipped (build: {})'.format(converter_c_error))
+                continue
+            runs = {}
+            try:
+                for side, side_command, repeat in [('candidate', command, args.repeat), ('reference', reference_cmd, 1)]:
+                    if side_command is None:
+                        continue
+                    directory = run_dir(work, 'runs', dataset, '{}_{}'.format(side, name))
+                    stage_input(directory, source, input_name)
+                    seconds = timed_run(side_command + [input_name], directory, repeat)
+                    runs[side] = (seconds, os.path.join(directory, prefix + input_name))
+            except EngineError as e:
+                report.add(dataset, name, 'ERROR ' + str(e))
+                continue
+            seconds, output = runs['candidate']
+            outputs[name] = output
+            if 'reference' not in runs:
+                report.add(dataset, name, 'no reference', n_points, seconds)
+            else:
+                coords = fixed_coords if name == 'trajectory_fixer.py' else converted_coords
+                report.add(dataset, name, status_of(compare_outputs(runs['reference'][1], output, coords)), n_points, seconds)
+
+        # -- my_converter_c against the python converter for the same (fixed) input
+        if 'my_converter_c' in outputs and 'mapmatched_converter.py' in outputs:
+            report.add(dataset, 'my_converter_c ~ mapmatched', status_of(compare_flattened(outputs['mapmatched_converter.py'], outputs['my_converter_c'])))
+
+    if not args.keep:
+        shutil.rmtree(work)
+    sys.exit(1 if report.failed else 0)
+
+if __name__ == '__main__':
+    main()
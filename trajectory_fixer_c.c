@@ -1,9 +1,24 @@
+#define _GNU_SOURCE // F_SETPIPE_SZ
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 #include <math.h>
 #include <string.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <errno.h>
+#ifdef USE_IO_URING
+#include <liburing.h> // gcc -DUSE_IO_URING ... -luring
+#endif
+#ifdef USE_ZLIB
+#include <zlib.h> // gcc -DUSE_ZLIB ... -lz
+#endif
+#ifdef USE_ZSTD
+#include <zstd.h> // gcc -DUSE_ZSTD ... -lzstd
+#endif
 
 #define R 6378137 // Radius of earth in m
 
@@ -13,6 +28,9 @@
 #define MIN_FULL_TRAJ_BOUNDARY 0.05
 #define MIN_BOUNDARY 0.005 // degrees
 
+#define IO_BUFFER_SIZE (4 << 20) // bytes
+#define IO_BUFFER_COUNT 4 // buffers in flight per stream
+
 #define max(a,b) \
     ({  __typeof__ (a) _a = (a); \
         __typeof__ (b) _b = (b); \
@@ -25,6 +43,8 @@
 
 #define toKmph(mps) 3.6 * mps
 
+FILE* messages; // progress and report, stderr when the output goes to stdout
+
 // --------------------------------------------------------------------
 // -----------------------   StopWatch   ------------------------------
 
@@ -40,6 +60,7 @@ StopWatch* newStopWatch(char* name) {
     watch->name = name;
     watch->current = 0;
     watch->running = 0;
+    return watch;
 }
 
 void startClock(StopWatch* watch) {
@@ -94,14 +115,19 @@ void flushProgress(ProgressBar* bar) {
     int seconds = totalTime % 60;
     float percentage = getPercentage(bar);
     
-    printf("\r%02d:%02d:%02d - [", hours, minutes, seconds);
+    if (bar->max_value <= 0) { // unknown size, e.g. compressed or piped input
+        fprintf(messages, "\r%02d:%02d:%02d - %lld points", hours, minutes, seconds, bar->current);
+        fflush(messages);
+        return;
+    }
+    fprintf(messages, "\r%02d:%02d:%02d - [", hours, minutes, seconds);
     int i;
     for(i = 0; i < round(percentage * bar->size); i++)
-        printf("#");
+        fprintf(messages, "#");
     for(i = 0; i < round((1 - percentage) * bar->size); i++)
-        printf(" ");
-    printf("] ( %.2f %% )", percentage*100);
-    fflush(stdout);
+        fprintf(messages, " ");
+    fprintf(messages, "] ( %.2f %% )", percentage*100);
+    fflush(messages);
 }
 
 void draw(ProgressBar* bar) {
@@ -111,7 +137,7 @@ void draw(ProgressBar* bar) {
         flushProgress(bar);
 }
 
-void set(ProgressBar* bar, int n) {
+void set(ProgressBar* bar, long long n) {
 	bar->current = n;
 	draw(bar);
 }
@@ -259,23 +285,905 @@ int isValid(Trajectory* trajectory) {
 }
 
 // ---------------------------------------------------------------------------
-// ---------------------------   Utils   -------------------------------------
+// ---------------------------   Async I/O   ---------------------------------
+//
+// Input is read ahead and output written behind in IO_BUFFER_COUNT buffers of
+// IO_BUFFER_SIZE bytes, so the processing threads only wait when the disk is
+// slower than the cleaning. Each stream has one long-lived I/O thread that does
+// all the reading or writing: through io_uring for regular files when compiled
+// with -DUSE_IO_URING, with plain read / write otherwise (or if the ring cannot
+// be set up). Time spent waiting is kept in `stall`, failures in `error`.
+
+double wallTime() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
 
-char* skipLine(FILE* input) {
-    char line[128];
-    return fgets(line, 128, input);
+typedef struct {
+    char* data;
+    long long length; // bytes filled (input) or pending (output)
+    long long done;   // bytes transferred so far by the current request
+    long long offset; // file offset (io_uring only)
+    int ready;        // input: filled, output: waiting to be written
+    int busy;         // request in flight (io_uring only)
+} IOBuffer;
+
+typedef struct {
+    int fd;
+    IOBuffer buffers[IO_BUFFER_COUNT];
+    int current;
+    long long position;
+    long long consumed; // bytes handed to the parser
+    int eof;
+    int error;
+    double stall;
+    long long stalls;
+    int useRing;
+#ifdef USE_IO_URING
+    struct io_uring ring;
+    long long offset;
+#endif
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int closing;
+} AsyncInput;
+
+typedef struct {
+    int fd;
+    IOBuffer buffers[IO_BUFFER_COUNT];
+    int current;
+    int error;
+    double stall;
+    long long stalls;
+    int useRing;
+#ifdef USE_IO_URING
+    struct io_uring ring;
+    long long offset;
+#endif
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int closing;
+} AsyncOutput;
+
+void initIOBuffers(IOBuffer* buffers) {
+    int i;
+    for (i = 0; i < IO_BUFFER_COUNT; i++) {
+        buffers[i].data = (char*) malloc(sizeof(char) * IO_BUFFER_SIZE);
+        buffers[i].length = 0;
+        buffers[i].done = 0;
+        buffers[i].offset = 0;
+        buffers[i].ready = 0;
+        buffers[i].busy = 0;
+    }
 }
 
-int getTotalNumberOfPoints(char* inputFileName) {
-    FILE* input = fopen(inputFileName, "r");
-    if (input == NULL) return -1;
-    
-    int counter = 0;
-    while( skipLine(input) ) counter++;
-    fclose(input);
-    return counter - 1;
+void freeIOBuffers(IOBuffer* buffers) {
+    int i;
+    for (i = 0; i < IO_BUFFER_COUNT; i++)
+        free(buffers[i].data);
+}
+
+int isRegularFile(int fd) {
+    struct stat info;
+    return fstat(fd, &info) == 0 && S_ISREG(info.st_mode);
+}
+
+const char* ioBackendName(int useRing) {
+    return useRing ? "io_uring" : "threads";
+}
+
+// ---------------------------   Read-ahead   ---------------------------------
+
+void* readAheadOnThread(void* param) {
+    AsyncInput* in = (AsyncInput*) param;
+    int i = 0;
+    while (1) {
+        IOBuffer* b = &in->buffers[i];
+        pthread_mutex_lock(&in->lock);
+        while (b->ready && !in->closing)
+            pthread_cond_wait(&in->changed, &in->lock);
+        int closing = in->closing;
+        pthread_mutex_unlock(&in->lock);
+        if (closing) break;
+
+        long long filled = 0;
+        ssize_t n;
+        while (filled < IO_BUFFER_SIZE && (n = read(in->fd, b->data + filled, IO_BUFFER_SIZE - filled)) > 0)
+            filled += n;
+        if (n < 0)
+            fprintf(messages, "Error reading input: %s\n", strerror(errno));
+
+        pthread_mutex_lock(&in->lock);
+        if (n < 0) {
+            in->error = 1;
+            filled = 0;
+        }
+        b->length = filled;
+        b->ready = 1;
+        pthread_cond_broadcast(&in->changed);
+        pthread_mutex_unlock(&in->lock);
+        if (filled < IO_BUFFER_SIZE) break; // end of input
+        i = (i + 1) % IO_BUFFER_COUNT;
+    }
+    return (void*) NULL;
+}
+
+#ifdef USE_IO_URING
+
+void prepareRead(AsyncInput* in, int i) {
+    IOBuffer* b = &in->buffers[i];
+    struct io_uring_sqe* sqe = io_uring_get_sqe(&in->ring);
+    io_uring_prep_read(sqe, in->fd, b->data + b->done, IO_BUFFER_SIZE - b->done, b->offset + b->done);
+    io_uring_sqe_set_data(sqe, (void*) (long) i);
+}
+
+// Keeps every free buffer queued on the ring, in file order, and hands the
+// completed ones to the parser.
+void* ringReadAheadOnThread(void* param) {
+    AsyncInput* in = (AsyncInput*) param;
+    int next = 0, inFlight = 0, stopped = 0;
+    while (1) {
+        int submitted = 0;
+        pthread_mutex_lock(&in->lock);
+        while (!in->closing && !stopped && inFlight == 0 && (in->buffers[next].ready || in->buffers[next].busy))
+            pthread_cond_wait(&in->changed, &in->lock);
+        if (in->closing)
+            stopped = 1;
+        while (!stopped && !in->buffers[next].ready && !in->buffers[next].busy) {
+            IOBuffer* b = &in->buffers[next];
+            b->offset = in->offset;
+            b->done = 0;
+            b->busy = 1;
+            in->offset += IO_BUFFER_SIZE;
+            prepareRead(in, next);
+            next = (next + 1) % IO_BUFFER_COUNT;
+            inFlight ++;
+            submitted ++;
+        }
+        pthread_mutex_unlock(&in->lock);
+        if (submitted)
+            io_uring_submit(&in->ring);
+        if (inFlight == 0) break; // stopped and drained
+
+        struct io_uring_cqe* cqe;
+        if (io_uring_wait_cqe(&in->ring, &cqe) < 0)
+            continue;
+        int i = (int) (long) io_uring_cqe_get_data(cqe);
+        int res = cqe->res;
+        io_uring_cqe_seen(&in->ring, cqe);
+
+        IOBuffer* b = &in->buffers[i];
+        if (res > 0 && b->done + res < IO_BUFFER_SIZE) {
+            b->done += res; // short read, ask for the rest
+            prepareRead(in, i);
+            io_uring_submit(&in->ring);
+            continue;
+        }
+        inFlight --;
+        if (res < 0)
+            fprintf(messages, "Error reading input: %s\n", strerror(-res));
+
+        pthread_mutex_lock(&in->lock);
+        if (res < 0) {
+            in->error = 1;
+            b->done = 0;
+        } else
+            b->done += res;
+        b->length = b->done;
+        b->busy = 0;
+        b->ready = 1;
+        if (res <= 0 || b->length < IO_BUFFER_SIZE)
+            stopped = 1; // end of input or error, drain what is in flight
+        pthread_cond_broadcast(&in->changed);
+        pthread_mutex_unlock(&in->lock);
+    }
+    return (void*) NULL;
+}
+
+#endif
+
+// `mayUseRing` is only set for files the tool opened itself: the ring reads at
+// explicit offsets and never moves the fd's position.
+AsyncInput* newAsyncInput(int fd, int mayUseRing) {
+    AsyncInput* in = (AsyncInput*) malloc(sizeof(AsyncInput));
+    in->fd = fd;
+    in->current = -1;
+    in->position = 0;
+    in->consumed = 0;
+    in->eof = 0;
+    in->error = 0;
+    in->stall = 0;
+    in->stalls = 0;
+    in->closing = 0;
+    in->useRing = mayUseRing && isRegularFile(fd);
+    initIOBuffers(in->buffers);
+    pthread_mutex_init(&in->lock, NULL);
+    pthread_cond_init(&in->changed, NULL);
+#ifdef USE_IO_URING
+    in->offset = 0;
+    if (in->useRing && io_uring_queue_init(2 * IO_BUFFER_COUNT, &in->ring, 0) == 0) {
+        pthread_create(&in->thread, NULL, ringReadAheadOnThread, (void*) in);
+        return in;
+    }
+#endif
+    in->useRing = 0;
+    pthread_create(&in->thread, NULL, readAheadOnThread, (void*) in);
+    return in;
+}
+
+// Releases the buffer being parsed and waits for the next one, returns 0 at end of input.
+int nextInputBuffer(AsyncInput* in) {
+    if (in->current >= 0 && in->buffers[in->current].length < IO_BUFFER_SIZE)
+        in->eof = 1; // a partial buffer is always the last one
+    if (in->eof) return 0;
+    IOBuffer* b;
+    double start = wallTime();
+    pthread_mutex_lock(&in->lock);
+    if (in->current >= 0) {
+        in->buffers[in->current].ready = 0;
+        pthread_cond_broadcast(&in->changed);
+    }
+    in->current = (in->current + 1) % IO_BUFFER_COUNT;
+    b = &in->buffers[in->current];
+    if (!b->ready) {
+        in->stalls ++;
+        while (!b->ready)
+            pthread_cond_wait(&in->changed, &in->lock);
+        in->stall += wallTime() - start;
+    }
+    in->consumed += b->length;
+    pthread_mutex_unlock(&in->lock);
+    in->position = 0;
+    if (b->length <= 0) {
+        in->eof = 1;
+        return 0;
+    }
+    return 1;
+}
+
+// Same contract as fgets.
+char* readLine(AsyncInput* in, char* line, int size) {
+    int n = 0;
+    while (n < size - 1) {
+        if ((in->current < 0 || in->position >= in->buffers[in->current].length) && !nextInputBuffer(in))
+            break;
+        IOBuffer* b = &in->buffers[in->current];
+        char* start = b->data + in->position;
+        long long available = min(b->length - in->position, (long long) (size - 1 - n));
+        char* newline = (char*) memchr(start, '\n', available);
+        long long count = newline != NULL ? newline - start + 1 : available;
+        memcpy(line + n, start, count);
+        n += count;
+        in->position += count;
+        if (newline != NULL) break;
+    }
+    if (n == 0) return NULL;
+    line[n] = '\0';
+    return line;
+}
+
+long long inputConsumed(AsyncInput* in) {
+    pthread_mutex_lock(&in->lock);
+    long long consumed = in->consumed;
+    pthread_mutex_unlock(&in->lock);
+    return consumed;
+}
+
+int inputFailed(AsyncInput* in) {
+    pthread_mutex_lock(&in->lock);
+    int error = in->error;
+    pthread_mutex_unlock(&in->lock);
+    return error;
+}
+
+void closeAsyncInput(AsyncInput* in) {
+    pthread_mutex_lock(&in->lock);
+    in->closing = 1;
+    pthread_cond_broadcast(&in->changed);
+    pthread_mutex_unlock(&in->lock);
+    pthread_join(in->thread, NULL);
+#ifdef USE_IO_URING
+    if (in->useRing)
+        io_uring_queue_exit(&in->ring);
+#endif
+    pthread_mutex_destroy(&in->lock);
+    pthread_cond_destroy(&in->changed);
+    freeIOBuffers(in->buffers);
+    close(in->fd);
+    free(in);
+}
+
+// ---------------------------   Write-behind   -------------------------------
+
+void* writeBehindOnThread(void* param) {
+    AsyncOutput* out = (AsyncOutput*) param;
+    int i = 0;
+    while (1) {
+        IOBuffer* b = &out->buffers[i];
+        pthread_mutex_lock(&out->lock);
+        while (!b->ready && !out->closing)
+            pthread_cond_wait(&out->changed, &out->lock);
+        int ready = b->ready, error = out->error;
+        pthread_mutex_unlock(&out->lock);
+        if (!ready) break; // closing and everything drained
+
+        long long written = 0;
+        ssize_t n = 0;
+        while (!error && written < b->length && (n = write(out->fd, b->data + written, b->length - written)) > 0)
+            written += n;
+        if (!error && written < b->length)
+            fprintf(messages, "Error writing output: %s\n", n < 0 ? strerror(errno) : "short write");
+
+        pthread_mutex_lock(&out->lock);
+        if (written < b->length)
+            out->error = 1; // later buffers are dropped
+        b->length = 0;
+        b->ready = 0;
+        pthread_cond_broadcast(&out->changed);
+        pthread_mutex_unlock(&out->lock);
+        i = (i + 1) % IO_BUFFER_COUNT;
+    }
+    return (void*) NULL;
+}
+
+#ifdef USE_IO_URING
+
+void prepareWrite(AsyncOutput* out, int i) {
+    IOBuffer* b = &out->buffers[i];
+    struct io_uring_sqe* sqe = io_uring_get_sqe(&out->ring);
+    io_uring_prep_write(sqe, out->fd, b->data + b->done, b->length - b->done, b->offset + b->done);
+    io_uring_sqe_set_data(sqe, (void*) (long) i);
+}
+
+// Queues every handed-over buffer on the ring at its place in the file and
+// frees it for the formatter once written.
+void* ringWriteBehindOnThread(void* param) {
+    AsyncOutput* out = (AsyncOutput*) param;
+    int next = 0, inFlight = 0;
+    while (1) {
+        int submitted = 0;
+        pthread_mutex_lock(&out->lock);
+        while (!out->closing && inFlight == 0 && !(out->buffers[next].ready && !out->buffers[next].busy))
+            pthread_cond_wait(&out->changed, &out->lock);
+        while (out->buffers[next].ready && !out->buffers[next].busy) {
+            IOBuffer* b = &out->buffers[next];
+            if (out->error) { // dropped after an error
+                b->length = 0;
+                b->ready = 0;
+                pthread_cond_broadcast(&out->changed);
+            } else {
+                b->offset = out->offset;
+                b->done = 0;
+                b->busy = 1;
+                out->offset += b->length;
+                prepareWrite(out, next);
+                inFlight ++;
+                submitted ++;
+            }
+            next = (next + 1) % IO_BUFFER_COUNT;
+        }
+        int closing = out->closing;
+        pthread_mutex_unlock(&out->lock);
+        if (submitted)
+            io_uring_submit(&out->ring);
+        if (inFlight == 0) {
+            if (closing) break;
+            continue;
+        }
+
+        struct io_uring_cqe* cqe;
+        if (io_uring_wait_cqe(&out->ring, &cqe) < 0)
+            continue;
+        int i = (int) (long) io_uring_cqe_get_data(cqe);
+        int res = cqe->res;
+        io_uring_cqe_seen(&out->ring, cqe);
+
+        IOBuffer* b = &out->buffers[i];
+        if (res > 0 && b->done + res < b->length) {
+            b->done += res; // short write, send the rest
+            prepareWrite(out, i);
+            io_uring_submit(&out->ring);
+            continue;
+        }
+        inFlight --;
+        if (res <= 0)
+            fprintf(messages, "Error writing output: %s\n", res < 0 ? strerror(-res) : "short write");
+
+        pthread_mutex_lock(&out->lock);
+        if (res <= 0)
+            out->error = 1;
+        b->length = 0;
+        b->busy = 0;
+        b->ready = 0;
+        pthread_cond_broadcast(&out->changed);
+        pthread_mutex_unlock(&out->lock);
+    }
+    return (void*) NULL;
+}
+
+#endif
+
+// Same as newAsyncInput: writes land at explicit offsets, so inherited or
+// O_APPEND fds (stdout) always go through the writer thread.
+AsyncOutput* newAsyncOutput(int fd, int mayUseRing) {
+    AsyncOutput* out = (AsyncOutput*) malloc(sizeof(AsyncOutput));
+    out->fd = fd;
+    out->current = 0;
+    out->error = 0;
+    out->stall = 0;
+    out->stalls = 0;
+    out->closing = 0;
+    out->useRing = mayUseRing && isRegularFile(fd);
+    initIOBuffers(out->buffers);
+    pthread_mutex_init(&out->lock, NULL);
+    pthread_cond_init(&out->changed, NULL);
+#ifdef USE_IO_URING
+    out->offset = 0;
+    if (out->useRing && io_uring_queue_init(2 * IO_BUFFER_COUNT, &out->ring, 0) == 0) {
+        pthread_create(&out->thread, NULL, ringWriteBehindOnThread, (void*) out);
+        return out;
+    }
+#endif
+    out->useRing = 0;
+    pthread_create(&out->thread, NULL, writeBehindOnThread, (void*) out);
+    return out;
+}
+
+// Hands the buffer being formatted to the writer and waits until the next one is free.
+void nextOutputBuffer(AsyncOutput* out) {
+    IOBuffer* b = &out->buffers[out->current];
+    double start = wallTime();
+    pthread_mutex_lock(&out->lock);
+    b->ready = 1;
+    pthread_cond_broadcast(&out->changed);
+    out->current = (out->current + 1) % IO_BUFFER_COUNT;
+    b = &out->buffers[out->current];
+    if (b->ready) {
+        out->stalls ++;
+        while (b->ready)
+            pthread_cond_wait(&out->changed, &out->lock);
+        out->stall += wallTime() - start;
+    }
+    pthread_mutex_unlock(&out->lock);
+}
+
+void writeBytes(AsyncOutput* out, const char* data, long long n) {
+    while (n > 0) {
+        IOBuffer* b = &out->buffers[out->current];
+        if (b->length == IO_BUFFER_SIZE) {
+            nextOutputBuffer(out);
+            continue;
+        }
+        long long count = min(n, IO_BUFFER_SIZE - b->length);
+        memcpy(b->data + b->length, data, count);
+        b->length += count;
+        data += count;
+        n -= count;
+    }
+}
+
+int hasPendingWrites(AsyncOutput* out) {
+    int i;
+    for (i = 0; i < IO_BUFFER_COUNT; i++)
+        if (out->buffers[i].ready) return 1;
+    return 0;
+}
+
+// Hands over the partially formatted buffer and waits until everything is written.
+void flushAsyncOutput(AsyncOutput* out) {
+    if (out->buffers[out->current].length > 0)
+        nextOutputBuffer(out);
+    double start = wallTime();
+    pthread_mutex_lock(&out->lock);
+    if (hasPendingWrites(out)) {
+        out->stalls ++;
+        while (hasPendingWrites(out))
+            pthread_cond_wait(&out->changed, &out->lock);
+        out->stall += wallTime() - start;
+    }
+    pthread_mutex_unlock(&out->lock);
+}
+
+int outputFailed(AsyncOutput* out) {
+    pthread_mutex_lock(&out->lock);
+    int error = out->error;
+    pthread_mutex_unlock(&out->lock);
+    return error;
+}
+
+void closeAsyncOutput(AsyncOutput* out) {
+    flushAsyncOutput(out);
+    pthread_mutex_lock(&out->lock);
+    out->closing = 1;
+    pthread_cond_broadcast(&out->changed);
+    pthread_mutex_unlock(&out->lock);
+    pthread_join(out->thread, NULL);
+#ifdef USE_IO_URING
+    if (out->useRing)
+        io_uring_queue_exit(&out->ring);
+#endif
+    pthread_mutex_destroy(&out->lock);
+    pthread_cond_destroy(&out->changed);
+    freeIOBuffers(out->buffers);
+    close(out->fd);
+    free(out);
 }
 
+// ---------------------------------------------------------------------------
+// ---------------------------   Compression   -------------------------------
+//
+// gzip / zstd streams are (de)compressed by a CodecStage on its own thread,
+// connected to AsyncInput / AsyncOutput through a pipe. The input format is
+// sniffed from the magic bytes, the output format follows the file extension.
+// Build with -DUSE_ZLIB -lz and/or -DUSE_ZSTD -lzstd to enable each codec.
+
+#define CODEC_NONE 0
+#define CODEC_GZIP 1
+#define CODEC_ZSTD 2
+
+#define CODEC_CHUNK_SIZE (1 << 20) // bytes
+#define PIPE_SIZE (1 << 20) // bytes, best effort
+
+typedef struct {
+    int codec;
+    int source;
+    int sink;
+    char prefix[4]; // bytes consumed while sniffing the input format
+    int prefixLength;
+    int error;
+    pthread_t thread;
+} CodecStage;
+
+const char* codecName(int codec) {
+    switch (codec) {
+        case CODEC_GZIP: return "gzip";
+        case CODEC_ZSTD: return "zstd";
+        default: return "plain";
+    }
+}
+
+int isCodecSupported(int codec) {
+    switch (codec) {
+#ifndef USE_ZLIB
+        case CODEC_GZIP: return 0;
+#endif
+#ifndef USE_ZSTD
+        case CODEC_ZSTD: return 0;
+#endif
+        default: return 1;
+    }
+}
+
+int codecFromMagic(unsigned char* magic, int length) {
+    if (length >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+        return CODEC_GZIP;
+    if (length >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+        return CODEC_ZSTD;
+    return CODEC_NONE;
+}
+
+int endsWith(char* name, char* suffix) {
+    int n = strlen(name), m = strlen(suffix);
+    return n >= m && strcmp(name + n - m, suffix) == 0;
+}
+
+int codecFromExtension(char* fileName) {
+    if (endsWith(fileName, ".gz"))
+        return CODEC_GZIP;
+    if (endsWith(fileName, ".zst") || endsWith(fileName, ".zstd"))
+        return CODEC_ZSTD;
+    return CODEC_NONE;
+}
+
+int writeFully(int fd, char* data, long long n) {
+    while (n > 0) {
+        ssize_t written = write(fd, data, n);
+        if (written <= 0) return 0;
+        data += written;
+        n -= written;
+    }
+    return 1;
+}
+
+ssize_t readSource(CodecStage* stage, char* data, long long n) {
+    if (stage->prefixLength > 0) {
+        int count = min((long long) stage->prefixLength, n);
+        memcpy(data, stage->prefix, count);
+        memmove(stage->prefix, stage->prefix + count, stage->prefixLength - count);
+        stage->prefixLength -= count;
+        return count;
+    }
+    return read(stage->source, data, n);
+}
+
+int copyStream(CodecStage* stage, char* in) {
+    ssize_t n;
+    while ((n = readSource(stage, in, CODEC_CHUNK_SIZE)) > 0)
+        if (!writeFully(stage->sink, in, n)) return 0;
+    return n == 0;
+}
+
+#ifdef USE_ZLIB
+
+int gunzipStream(CodecStage* stage, char* in, char* out) {
+    z_stream z;
+    memset(&z, 0, sizeof(z_stream));
+    inflateInit2(&z, 15 + 32); // gzip or zlib header
+    int status = Z_OK;
+    ssize_t n;
+    while ((n = readSource(stage, in, CODEC_CHUNK_SIZE)) > 0) {
+        z.next_in = (Bytef*) in;
+        z.avail_in = n;
+        do {
+            if (status == Z_STREAM_END && z.avail_in > 0)
+                inflateReset(&z); // concatenated members
+            z.next_out = (Bytef*) out;
+            z.avail_out = CODEC_CHUNK_SIZE;
+            status = inflate(&z, Z_NO_FLUSH);
+            if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) {
+                fprintf(messages, "Error decompressing gzip input: %s\n", z.msg != NULL ? z.msg : "corrupt data");
+                inflateEnd(&z);
+                return 0;
+            }
+            if (!writeFully(stage->sink, out, CODEC_CHUNK_SIZE - z.avail_out)) {
+                inflateEnd(&z);
+                return 0;
+            }
+        } while (z.avail_in > 0 || z.avail_out == 0);
+    }
+    inflateEnd(&z);
+    if (n < 0)
+        return 0;
+    if (status != Z_STREAM_END) {
+        fprintf(messages, "Error decompressing gzip input: truncated stream\n");
+        return 0;
+    }
+    return 1;
+}
+
+int gzipStream(CodecStage* stage, char* in, char* out) {
+    z_stream z;
+    memset(&z, 0, sizeof(z_stream));
+    deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+    int flush;
+    do {
+        ssize_t n = read(stage->source, in, CODEC_CHUNK_SIZE);
+        if (n < 0) {
+            deflateEnd(&z);
+            return 0;
+        }
+        flush = n == 0 ? Z_FINISH : Z_NO_FLUSH;
+        z.next_in = (Bytef*) in;
+        z.avail_in = n;
+        do {
+            z.next_out = (Bytef*) out;
+            z.avail_out = CODEC_CHUNK_SIZE;
+            deflate(&z, flush);
+            if (!writeFully(stage->sink, out, CODEC_CHUNK_SIZE - z.avail_out)) {
+                deflateEnd(&z);
+                return 0;
+            }
+        } while (z.avail_out == 0);
+    } while (flush != Z_FINISH);
+    deflateEnd(&z);
+    return 1;
+}
+
+#endif
+
+#ifdef USE_ZSTD
+
+int unzstdStream(CodecStage* stage, char* in, char* out) {
+    ZSTD_DStream* zstd = ZSTD_createDStream();
+    ZSTD_initDStream(zstd);
+    size_t status = 0;
+    ssize_t n;
+    while ((n = readSource(stage, in, CODEC_CHUNK_SIZE)) > 0) {
+        ZSTD_inBuffer input = { in, n, 0 };
+        ZSTD_outBuffer output;
+        do {
+            output.dst = out;
+            output.size = CODEC_CHUNK_SIZE;
+            output.pos = 0;
+            status = ZSTD_decompressStream(zstd, &output, &input);
+            if (ZSTD_isError(status)) {
+                fprintf(messages, "Error decompressing zstd input: %s\n", ZSTD_getErrorName(status));
+                ZSTD_freeDStream(zstd);
+                return 0;
+            }
+            if (!writeFully(stage->sink, out, output.pos)) {
+                ZSTD_freeDStream(zstd);
+                return 0;
+            }
+        } while (input.pos < input.size || output.pos == output.size);
+    }
+    ZSTD_freeDStream(zstd);
+    if (n < 0)
+        return 0;
+    if (status != 0) {
+        fprintf(messages, "Error decompressing zstd input: truncated stream\n");
+        return 0;
+    }
+    return 1;
+}
+
+int zstdStream(CodecStage* stage, char* in, char* out) {
+    ZSTD_CCtx* zstd = ZSTD_createCCtx();
+    ZSTD_EndDirective mode;
+    do {
+        ssize_t n = read(stage->source, in, CODEC_CHUNK_SIZE);
+        if (n < 0) {
+            ZSTD_freeCCtx(zstd);
+            return 0;
+        }
+        mode = n == 0 ? ZSTD_e_end : ZSTD_e_continue;
+        ZSTD_inBuffer input = { in, n, 0 };
+        int finished;
+        do {
+            ZSTD_outBuffer output = { out, CODEC_CHUNK_SIZE, 0 };
+            size_t remaining = ZSTD_compressStream2(zstd, &output, &input, mode);
+            if (ZSTD_isError(remaining)) {
+                fprintf(messages, "Error compressing zstd output: %s\n", ZSTD_getErrorName(remaining));
+                ZSTD_freeCCtx(zstd);
+                return 0;
+            }
+            if (!writeFully(stage->sink, out, output.pos)) {
+                ZSTD_freeCCtx(zstd);
+                return 0;
+            }
+            finished = mode == ZSTD_e_end ? remaining == 0 : input.pos == input.size;
+        } while (!finished);
+    } while (mode != ZSTD_e_end);
+    ZSTD_freeCCtx(zstd);
+    return 1;
+}
+
+#endif
+
+void* decompressOnThread(void* param) {
+    CodecStage* stage = (CodecStage*) param;
+    char* in = (char*) malloc(sizeof(char) * CODEC_CHUNK_SIZE);
+    char* out = (char*) malloc(sizeof(char) * CODEC_CHUNK_SIZE);
+    int ok;
+    switch (stage->codec) {
+#ifdef USE_ZLIB
+        case CODEC_GZIP: ok = gunzipStream(stage, in, out); break;
+#endif
+#ifdef USE_ZSTD
+        case CODEC_ZSTD: ok = unzstdStream(stage, in, out); break;
+#endif
+        default: ok = copyStream(stage, in);
+    }
+    stage->error = !ok;
+    free(in);
+    free(out);
+    close(stage->sink); // end of input for the reader
+    close(stage->source);
+    return (void*) NULL;
+}
+
+void* compressOnThread(void* param) {
+    CodecStage* stage = (CodecStage*) param;
+    char* in = (char*) malloc(sizeof(char) * CODEC_CHUNK_SIZE);
+    char* out = (char*) malloc(sizeof(char) * CODEC_CHUNK_SIZE);
+    int ok;
+    switch (stage->codec) {
+#ifdef USE_ZLIB
+        case CODEC_GZIP: ok = gzipStream(stage, in, out); break;
+#endif
+#ifdef USE_ZSTD
+        case CODEC_ZSTD: ok = zstdStream(stage, in, out); break;
+#endif
+        default: ok = copyStream(stage, in);
+    }
+    if (!ok)
+        fprintf(messages, "Error writing %s output: %s\n", codecName(stage->codec), strerror(errno));
+    stage->error = !ok;
+    free(in);
+    free(out);
+    close(stage->source); // the writer sees a broken pipe if this stage failed
+    if (close(stage->sink) != 0 && ok) {
+        fprintf(messages, "Error writing %s output: %s\n", codecName(stage->codec), strerror(errno));
+        stage->error = 1;
+    }
+    return (void*) NULL;
+}
+
+CodecStage* newCodecStage(int codec, int source, int sink) {
+    CodecStage* stage = (CodecStage*) malloc(sizeof(CodecStage));
+    stage->codec = codec;
+    stage->source = source;
+    stage->sink = sink;
+    stage->prefixLength = 0;
+    stage->error = 0;
+    return stage;
+}
+
+int newPipe(int* ends) {
+    if (pipe(ends) != 0) return 0;
+#ifdef F_SETPIPE_SZ
+    fcntl(ends[1], F_SETPIPE_SZ, PIPE_SIZE);
+#endif
+    return 1;
+}
+
+// Opens `fileName` ("-" for stdin) and returns the fd to parse from. Compressed
+// and non-seekable input get a decompression stage returned through `stage`.
+int openInput(char* fileName, CodecStage** stage) {
+    int ends[2];
+    unsigned char magic[4];
+    int length = 0;
+    ssize_t n;
+    int fd = strcmp(fileName, "-") == 0 ? dup(STDIN_FILENO) : open(fileName, O_RDONLY);
+    *stage = NULL;
+    if (fd < 0) return -1;
+
+    while (length < 4 && (n = read(fd, magic + length, 4 - length)) > 0)
+        length += n;
+    if (n < 0) {
+        fprintf(messages, "Error reading input: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    int codec = codecFromMagic(magic, length);
+    if (!isCodecSupported(codec)) {
+        fprintf(messages, "%s input needs a build with %s\n", codecName(codec), codec == CODEC_GZIP ? "-DUSE_ZLIB -lz" : "-DUSE_ZSTD -lzstd");
+        close(fd);
+        return -1;
+    }
+    if (codec == CODEC_NONE && lseek(fd, -length, SEEK_CUR) >= 0)
+        return fd;
+
+    if (!newPipe(ends)) {
+        close(fd);
+        return -1;
+    }
+    *stage = newCodecStage(codec, fd, ends[1]);
+    memcpy((*stage)->prefix, magic, length);
+    (*stage)->prefixLength = length;
+    pthread_create(&(*stage)->thread, NULL, decompressOnThread, (void*) *stage);
+    return ends[0];
+}
+
+// Opens `fileName` ("-" for stdout) and returns the fd to write to. Names ending
+// in .gz / .zst get a compression stage returned through `stage`.
+int openOutput(char* fileName, CodecStage** stage) {
+    int ends[2];
+    int codec = strcmp(fileName, "-") == 0 ? CODEC_NONE : codecFromExtension(fileName);
+    *stage = NULL;
+    if (!isCodecSupported(codec)) {
+        fprintf(messages, "%s output needs a build with %s\n", codecName(codec), codec == CODEC_GZIP ? "-DUSE_ZLIB -lz" : "-DUSE_ZSTD -lzstd");
+        return -1;
+    }
+    int fd = strcmp(fileName, "-") == 0 ? dup(STDOUT_FILENO) : open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || codec == CODEC_NONE)
+        return fd;
+
+    if (!newPipe(ends)) {
+        close(fd);
+        return -1;
+    }
+    *stage = newCodecStage(codec, ends[0], fd);
+    pthread_create(&(*stage)->thread, NULL, compressOnThread, (void*) *stage);
+    return ends[1];
+}
+
+// Waits for the stage to drain, returns 1 if it failed. The pipe end owned by
+// the caller must be closed first.
+int closeCodecStage(CodecStage* stage) {
+    if (stage == NULL) return 0;
+    pthread_join(stage->thread, NULL);
+    int error = stage->error;
+    free(stage);
+    return error;
+}
+
+// ---------------------------------------------------------------------------
+// ---------------------------   Utils   -------------------------------------
+
 char* getOutputFileName(char* inputFileName) {
     char* outputFileName = (char*) malloc(sizeof(char)*(strlen(inputFileName) + 8));
     strcpy(outputFileName, "cfixed_");
@@ -283,12 +1191,12 @@ char* getOutputFileName(char* inputFileName) {
     return outputFileName;
 }
 
-Point* readPoint(FILE* input) {
+Point* readPoint(AsyncInput* input) {
     int id;
     double lat, lng;
     long long timestamp;
-    char* line = (char*) malloc(sizeof(char) * 128);
-    if (fgets(line, 128, input) == NULL)
+    char line[128];
+    if (readLine(input, line, 128) == NULL)
         return NULL;
     sscanf(line, "%d;%lf;%lf;%lld", &id, &lat, &lng, &timestamp);
     // if (feof(input)) return NULL;
@@ -298,15 +1206,16 @@ Point* readPoint(FILE* input) {
 }
 
 typedef struct {
-    FILE* input;
+    AsyncInput* input;
     Point* buffer;
 } TrajectoryReader;
 
-TrajectoryReader* newTrajectoryReader(FILE* input) {
+TrajectoryReader* newTrajectoryReader(AsyncInput* input) {
     TrajectoryReader* reader = (TrajectoryReader*) malloc(sizeof(TrajectoryReader));
+    char header[128];
     reader->input = input;
     reader->buffer = NULL;
-    skipLine(input);
+    readLine(input, header, 128);
     return reader;
 }
 
@@ -331,24 +1240,26 @@ Trajectory* readTrajectory(TrajectoryReader* reader) {
 }
 
 typedef struct {
-    FILE* output;
+    AsyncOutput* output;
     int nextId;
 } TrajectoryWriter;
 
-TrajectoryWriter* newTrajectoryWriter(FILE* output) {
+TrajectoryWriter* newTrajectoryWriter(AsyncOutput* output) {
     TrajectoryWriter* writer = (TrajectoryWriter*) malloc(sizeof(TrajectoryWriter));
+    char* header = "driver_id;id;lat;lng;timestamp\n";
     writer->output = output;
     writer->nextId = 0;
-    fprintf(output, "driver_id;id;lat;lng;timestamp\n");
+    writeBytes(output, header, strlen(header));
     return writer;
 }
 
 void writeTrajectory(TrajectoryWriter* writer, Trajectory* t) {
     int i;
+    char line[128];
     for (i = 0; i < t->filled; i++) {
         Point* p = t->points[i];
         if (i > 0 && p->t != t->points[i-1]->t)
-            fprintf(writer->output, "%d;%d;%.8lf;%.8lf;%lld\n", p->taxiId, writer->nextId, p->lat, p->lng, p->t);
+            writeBytes(writer->output, line, sprintf(line, "%d;%d;%.8lf;%.8lf;%lld\n", p->taxiId, writer->nextId, p->lat, p->lng, p->t));
     }
     writer->nextId ++;
 }
@@ -453,23 +1364,33 @@ void* readTrajectoryOnThread(void* reader) {
     return (void*) readTrajectory((TrajectoryReader*) reader);
 }
 
-void readAndProcess(char* inputFileName, StopWatch** watches) {
-    startClock(watches[5]);
-    long long totalNumberOfPoints = getTotalNumberOfPoints(inputFileName);
-    stopClock(watches[5]);
-    // printf("N points: %lld\n", totalNumberOfPoints);
-    char* outputFileName = getOutputFileName(inputFileName);
-    FILE* input = fopen(inputFileName, "r");
-    FILE* output = fopen(outputFileName, "w");
-    if (input == NULL || output == NULL) {
-        printf("Error opening files\n");
-        return;
+// Returns 0 on success, 1 if anything failed (the output is then incomplete).
+int readAndProcess(char* inputFileName, char* outputFileName, StopWatch** watches) {
+    CodecStage* inputStage;
+    CodecStage* outputStage;
+    int inputFd = openInput(inputFileName, &inputStage);
+    int outputFd = inputFd < 0 ? -1 : openOutput(outputFileName, &outputStage);
+    if (inputFd < 0 || outputFd < 0) {
+        fprintf(messages, "Error opening files\n");
+        if (inputFd >= 0) {
+            close(inputFd);
+            closeCodecStage(inputStage);
+        }
+        return 1;
     }
+    struct stat info;
+    long long totalBytes = -1; // progress in bytes for plain files, in points otherwise
+    if (inputStage == NULL && fstat(inputFd, &info) == 0 && S_ISREG(info.st_mode))
+        totalBytes = info.st_size;
+    AsyncInput* input = newAsyncInput(inputFd, inputStage == NULL && strcmp(inputFileName, "-") != 0);
+    AsyncOutput* output = newAsyncOutput(outputFd, outputStage == NULL && strcmp(outputFileName, "-") != 0);
 
-    printf("Fixing: %s => %s\n", inputFileName, outputFileName);
+    fprintf(messages, "Fixing: %s => %s\n", inputFileName, outputFileName);
+    fprintf(messages, "Codecs: %s => %s\n", codecName(inputStage != NULL ? inputStage->codec : CODEC_NONE), codecName(outputStage != NULL ? outputStage->codec : CODEC_NONE));
+    fprintf(messages, "I/O: %s read-ahead, %s write-behind\n", ioBackendName(input->useRing), ioBackendName(output->useRing));
 
     StopWatch* watch = newStopWatch("Algorithm time");
-    ProgressBar* progress = newProgressBar(totalNumberOfPoints, 50, watch);
+    ProgressBar* progress = newProgressBar(totalBytes, 50, watch);
     draw(progress);
     TrajectoryReader* reader = newTrajectoryReader(input);
     TrajectoryWriter* writer = newTrajectoryWriter(output);
@@ -481,7 +1402,7 @@ void readAndProcess(char* inputFileName, StopWatch** watches) {
 
     Trajectory* t = readTrajectory(reader);
 
-    while(t != NULL) {
+    while(t != NULL && !outputFailed(output)) {
 
         pthread_create(&pid1, NULL, readTrajectoryOnThread, (void*) reader);
         
@@ -490,7 +1411,7 @@ void readAndProcess(char* inputFileName, StopWatch** watches) {
 
         pthread_join(pid2, NULL);
 
-        set(progress, progress->current + t->filled);
+        set(progress, totalBytes > 0 ? inputConsumed(input) : progress->current + t->filled);
         freeTrajectory(t);
 
         pthread_join(pid1, (void**)(&t));
@@ -499,34 +1420,53 @@ void readAndProcess(char* inputFileName, StopWatch** watches) {
     stopClock(watch);
 
     flushProgress(progress);
-    printf("\n");
-
-    fclose(input);
-    fclose(output);
+    fprintf(messages, "\n");
+
+    flushAsyncOutput(output);
+    fprintf(messages, "read_stall : %.2lf s (%lld waits)\n", input->stall, input->stalls);
+    fprintf(messages, "write_stall : %.2lf s (%lld waits)\n", output->stall, output->stalls);
+    int failed = inputFailed(input) || outputFailed(output);
+    closeAsyncInput(input);
+    failed |= closeCodecStage(inputStage);
+    closeAsyncOutput(output);
+    failed |= closeCodecStage(outputStage);
+    return failed;
 }
 
 
 // -----------------------------------------------------------------------------
 // -------------------------------   Main   ------------------------------------
 
+// trajectory_fixer_c <input> [output], "-" reads stdin / writes stdout.
+// Without an output, a piped input goes to stdout and a file to cfixed_<input>.
 int main(int argc, char** argv) {
 
-    printf("max angular speed: %lf\n", MAX_ANGULAR_SPEED);
-
-    if (argc != 2) {
-        printf("Invalid number of arguments, expected 2, found %d\n", argc);
+    messages = stdout;
+    if (argc != 2 && argc != 3) {
+        printf("Invalid number of arguments, expected 2 or 3, found %d\n", argc);
         return 1;
     }
+    char* outputFileName;
+    if (argc == 3)
+        outputFileName = argv[2];
+    else if (strcmp(argv[1], "-") == 0)
+        outputFileName = "-";
+    else
+        outputFileName = getOutputFileName(argv[1]);
+    if (strcmp(outputFileName, "-") == 0)
+        messages = stderr;
+    signal(SIGPIPE, SIG_IGN); // a closed pipe shows up as a write error instead
+
+    fprintf(messages, "max angular speed: %lf\n", MAX_ANGULAR_SPEED);
     StopWatch* watches[] = {newStopWatch("main_process"), 
                             newStopWatch("sort"), 
                             newStopWatch("actual_slice"), 
                             newStopWatch("write_trajectory"),
-                            newStopWatch("get_nearest_point"), 
-                            newStopWatch("number_of_points")};
-    readAndProcess(argv[1], watches);
+                            newStopWatch("get_nearest_point")};
+    int failed = readAndProcess(argv[1], outputFileName, watches);
     int i;
-    for (i = 0; i < 6; i++) {
-        printf("%s : %.2lf s\n", watches[i]->name, watches[i]->current);
+    for (i = 0; i < 5; i++) {
+        fprintf(messages, "%s : %.2lf s\n", watches[i]->name, watches[i]->current);
     }
-	return 0;
+	return failed;
 }